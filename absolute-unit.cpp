@@ -1,12 +1,52 @@
 #include "clang/Index/IndexUnitReader.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dispatch/dispatch.h>
+#include <re2/re2.h>
 
 using namespace llvm;
+using namespace llvm::sys;
 using namespace clang;
 using namespace clang::index;
 
-static cl::list<std::string> UnitPaths(cl::Positional, cl::OneOrMore,
-                                       cl::desc("<index-units>"));
+static cl::list<std::string>
+    UnitPaths(cl::Positional, cl::OneOrMore,
+              cl::desc("<index-units or index-store directories>"));
+
+enum class OutputFormat { YAML, JSONLines };
+
+static cl::opt<OutputFormat> Format(
+    "format", cl::desc("Output format"), cl::init(OutputFormat::YAML),
+    cl::values(clEnumValN(OutputFormat::YAML, "yaml", "YAML documents"),
+               clEnumValN(OutputFormat::JSONLines, "jsonl",
+                          "One JSON object per line")));
+
+static cl::opt<std::string>
+    ModuleFilter("module", cl::desc("Only print units of the given module"),
+                 cl::value_desc("name"));
+
+static cl::opt<std::string> OutputFileFilter(
+    "output-file-regex",
+    cl::desc("Only print units whose output file matches the regex"),
+    cl::value_desc("regex"));
+
+static cl::opt<std::string> DependencyFilter(
+    "dependency",
+    cl::desc("Only print units with a dependency on the given file path"),
+    cl::value_desc("path"));
+
+// Units are decoded in parallel, in batches of this size. The output of each
+// batch is buffered, and then printed in order.
+static const size_t BatchSize = 1024;
 
 static const char *_dependencyKindName(IndexUnitReader::DependencyKind kind) {
   switch (kind) {
@@ -21,65 +61,238 @@ static const char *_dependencyKindName(IndexUnitReader::DependencyKind kind) {
 
 #define INDENT "    "
 
+// The result of decoding a single unit.
+struct UnitResult {
+  std::string output;
+  std::string error;
+};
+
+// Expands index store directories into the paths of their units. Unit paths
+// are passed through as is.
+static bool collectUnitPaths(std::vector<std::string> &unitPaths) {
+  bool success = true;
+  for (const auto &unitPath : UnitPaths) {
+    if (not fs::is_directory(unitPath)) {
+      unitPaths.push_back(unitPath);
+      continue;
+    }
+
+    SmallString<256> unitDirectory;
+    path::append(unitDirectory, unitPath, "v5", "units");
+
+    std::vector<std::string> storeUnitPaths;
+    std::error_code dirError;
+    fs::directory_iterator dir{unitDirectory, dirError};
+    fs::directory_iterator end;
+    for (; dir != end && !dirError; dir.increment(dirError)) {
+      storeUnitPaths.push_back(dir->path());
+    }
+
+    if (dirError) {
+      errs() << "error: failed to read unit directory " << unitDirectory
+             << " -- " << dirError.message() << "\n";
+      success = false;
+    }
+
+    // Directory order is arbitrary, sort for stable output.
+    std::sort(storeUnitPaths.begin(), storeUnitPaths.end());
+    unitPaths.insert(unitPaths.end(), storeUnitPaths.begin(),
+                     storeUnitPaths.end());
+  }
+
+  return success;
+}
+
+static bool matchesFilters(IndexUnitReader &reader,
+                           const re2::RE2 *outputFileRegex) {
+  if (not ModuleFilter.empty() && reader.getModuleName() != ModuleFilter) {
+    return false;
+  }
+
+  if (outputFileRegex &&
+      not re2::RE2::PartialMatch(reader.getOutputFile().str(),
+                                 *outputFileRegex)) {
+    return false;
+  }
+
+  if (not DependencyFilter.empty()) {
+    bool found = false;
+    reader.foreachDependency([&](const IndexUnitReader::DependencyInfo &info) {
+      found = info.FilePath == DependencyFilter;
+      return not found;
+    });
+    return found;
+  }
+
+  return true;
+}
+
+// Output using a yaml format.
+static void printYAML(StringRef unitPath, IndexUnitReader &reader,
+                      raw_ostream &os) {
+  os << "---\n";
+  os << "# " << unitPath << "\n";
+  os << "WorkingDirectory: " << reader.getWorkingDirectory() << "\n"
+     << "MainFilePath: " << reader.getMainFilePath() << "\n"
+     << "OutputFile: " << reader.getOutputFile() << "\n"
+     << "ModuleName: " << reader.getModuleName() << "\n"
+     << "IsSystemUnit: " << reader.isSystemUnit() << "\n"
+     << "IsModuleUnit: " << reader.isModuleUnit() << "\n"
+     << "IsDebugCompilation: " << reader.isDebugCompilation() << "\n"
+     << "CompilationTarget: " << reader.getTarget() << "\n"
+     << "SysrootPath: " << reader.getSysrootPath() << "\n"
+     << "ProviderIdentifier: " << reader.getProviderIdentifier() << "\n"
+     << "ProviderVersion: " << reader.getProviderVersion() << "\n";
+
+  bool needsHeader = true;
+  reader.foreachDependency([&](const IndexUnitReader::DependencyInfo &info) {
+    if (needsHeader) {
+      os << "Dependencies:\n";
+      needsHeader = false;
+    }
+
+    os << INDENT "- DependencyKind: " << _dependencyKindName(info.Kind) << "\n"
+       << INDENT "  IsSystem: " << info.IsSystem << "\n"
+       << INDENT "  UnitOrRecordName: " << info.UnitOrRecordName << "\n"
+       << INDENT "  FilePath: " << info.FilePath << "\n"
+       << INDENT "  ModuleName: " << info.ModuleName << "\n";
+    return true;
+  });
+
+  needsHeader = true;
+  reader.foreachInclude([&](const IndexUnitReader::IncludeInfo &info) {
+    if (needsHeader) {
+      os << "Includes:\n";
+      needsHeader = false;
+    }
+
+    os << INDENT "- SourcePath: " << info.SourcePath << "\n"
+       << INDENT "  SourceLine: " << info.SourceLine << "\n"
+       << INDENT "  TargetPath: " << info.TargetPath << "\n";
+    return true;
+  });
+}
+
+// JSON strings must be valid UTF-8, which paths are not guaranteed to be.
+static json::Value jsonString(StringRef str) {
+  if (json::isUTF8(str)) {
+    return str;
+  }
+  return json::fixUTF8(str);
+}
+
+// Output one JSON object per line, using the same keys as the yaml format.
+static void printJSONLine(StringRef unitPath, IndexUnitReader &reader,
+                          raw_ostream &os) {
+  json::OStream json(os);
+  json.object([&] {
+    json.attribute("UnitPath", jsonString(unitPath));
+    json.attribute("WorkingDirectory",
+                   jsonString(reader.getWorkingDirectory()));
+    json.attribute("MainFilePath", jsonString(reader.getMainFilePath()));
+    json.attribute("OutputFile", jsonString(reader.getOutputFile()));
+    json.attribute("ModuleName", jsonString(reader.getModuleName()));
+    json.attribute("IsSystemUnit", reader.isSystemUnit());
+    json.attribute("IsModuleUnit", reader.isModuleUnit());
+    json.attribute("IsDebugCompilation", reader.isDebugCompilation());
+    json.attribute("CompilationTarget", jsonString(reader.getTarget()));
+    json.attribute("SysrootPath", jsonString(reader.getSysrootPath()));
+    json.attribute("ProviderIdentifier",
+                   jsonString(reader.getProviderIdentifier()));
+    json.attribute("ProviderVersion", jsonString(reader.getProviderVersion()));
+
+    json.attributeArray("Dependencies", [&] {
+      reader.foreachDependency(
+          [&](const IndexUnitReader::DependencyInfo &info) {
+            json.object([&] {
+              json.attribute("DependencyKind", _dependencyKindName(info.Kind));
+              json.attribute("IsSystem", info.IsSystem);
+              json.attribute("UnitOrRecordName",
+                             jsonString(info.UnitOrRecordName));
+              json.attribute("FilePath", jsonString(info.FilePath));
+              json.attribute("ModuleName", jsonString(info.ModuleName));
+            });
+            return true;
+          });
+    });
+
+    json.attributeArray("Includes", [&] {
+      reader.foreachInclude([&](const IndexUnitReader::IncludeInfo &info) {
+        json.object([&] {
+          json.attribute("SourcePath", jsonString(info.SourcePath));
+          json.attribute("SourceLine", info.SourceLine);
+          json.attribute("TargetPath", jsonString(info.TargetPath));
+        });
+        return true;
+      });
+    });
+  });
+  os << "\n";
+}
+
+static void decodeUnit(StringRef unitPath, const re2::RE2 *outputFileRegex,
+                       UnitResult &result) {
+  PathRemapper clangPathRemapper;
+  std::string readerError;
+  auto reader = IndexUnitReader::createWithFilePath(unitPath, clangPathRemapper,
+                                                    readerError);
+  if (not reader) {
+    raw_string_ostream err(result.error);
+    err << "error: failed to read unit file " << unitPath << " -- "
+        << readerError << "\n";
+    return;
+  }
+
+  if (not matchesFilters(*reader, outputFileRegex)) {
+    return;
+  }
+
+  raw_string_ostream os(result.output);
+  switch (Format) {
+  case OutputFormat::YAML:
+    printYAML(unitPath, *reader, os);
+    break;
+  case OutputFormat::JSONLines:
+    printJSONLine(unitPath, *reader, os);
+    break;
+  }
+}
+
 int main(int argc, char **argv) {
   cl::ParseCommandLineOptions(argc, argv);
 
-  for (const auto &unitPath : UnitPaths) {
-    PathRemapper clangPathRemapper;
-    std::string readerError;
-    auto reader = IndexUnitReader::createWithFilePath(
-        unitPath, clangPathRemapper, readerError);
-    if (not reader) {
-      errs() << "error: failed to read unit file " << unitPath << " -- "
-             << readerError << "\n";
+  std::unique_ptr<re2::RE2> outputFileRegex;
+  if (not OutputFileFilter.empty()) {
+    outputFileRegex = std::make_unique<re2::RE2>(OutputFileFilter);
+    if (not outputFileRegex->ok()) {
+      errs() << "error: invalid regex '" << OutputFileFilter
+             << "': " << outputFileRegex->error() << "\n";
       return EXIT_FAILURE;
     }
+  }
 
-    // Output using a yaml format.
-
-    outs() << "---\n";
-    outs() << "# " << unitPath << "\n";
-    outs() << "WorkingDirectory: " << reader->getWorkingDirectory() << "\n"
-           << "MainFilePath: " << reader->getMainFilePath() << "\n"
-           << "OutputFile: " << reader->getOutputFile() << "\n"
-           << "ModuleName: " << reader->getModuleName() << "\n"
-           << "IsSystemUnit: " << reader->isSystemUnit() << "\n"
-           << "IsModuleUnit: " << reader->isModuleUnit() << "\n"
-           << "IsDebugCompilation: " << reader->isDebugCompilation() << "\n"
-           << "CompilationTarget: " << reader->getTarget() << "\n"
-           << "SysrootPath: " << reader->getSysrootPath() << "\n"
-           << "ProviderIdentifier: " << reader->getProviderIdentifier() << "\n"
-           << "ProviderVersion: " << reader->getProviderVersion() << "\n";
-
-    bool needsHeader = true;
-    reader->foreachDependency([&](const IndexUnitReader::DependencyInfo &info) {
-      if (needsHeader) {
-        outs() << "Dependencies:\n";
-        needsHeader = false;
-      }
+  std::vector<std::string> unitPaths;
+  auto exitStatus = collectUnitPaths(unitPaths) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  const std::string *paths = unitPaths.data();
+  const re2::RE2 *regex = outputFileRegex.get();
+  for (size_t start = 0; start < unitPaths.size(); start += BatchSize) {
+    const size_t count = std::min(BatchSize, unitPaths.size() - start);
+    std::vector<UnitResult> results(count);
+    UnitResult *resultsData = results.data();
 
-      outs() << INDENT "- DependencyKind: " << _dependencyKindName(info.Kind)
-             << "\n"
-             << INDENT "  IsSystem: " << info.IsSystem << "\n"
-             << INDENT "  UnitOrRecordName: " << info.UnitOrRecordName << "\n"
-             << INDENT "  FilePath: " << info.FilePath << "\n"
-             << INDENT "  ModuleName: " << info.ModuleName << "\n";
-      return true;
+    dispatch_apply(count, DISPATCH_APPLY_AUTO, ^(size_t index) {
+      decodeUnit(paths[start + index], regex, resultsData[index]);
     });
 
-    needsHeader = true;
-    reader->foreachInclude([&](const IndexUnitReader::IncludeInfo &info) {
-      if (needsHeader) {
-        outs() << "Includes:\n";
-        needsHeader = false;
+    for (const auto &result : results) {
+      if (not result.error.empty()) {
+        exitStatus = EXIT_FAILURE;
+        errs() << result.error;
       }
-
-      outs() << INDENT "- SourcePath: " << info.SourcePath << "\n"
-             << INDENT "  SourceLine: " << info.SourceLine << "\n"
-             << INDENT "  TargetPath: " << info.TargetPath << "\n";
-      return true;
-    });
+      outs() << result.output;
+    }
   }
 
-  return EXIT_SUCCESS;
+  return exitStatus;
 }
@@ -2,20 +2,35 @@
 #include "clang/Index/IndexUnitReader.h"
 #include "clang/Index/IndexUnitWriter.h"
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/xxhash.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <iterator>
+#include <mutex>
 #include <regex>
 #include <set>
 #include <string>
 #include <vector>
 
 #include <dispatch/dispatch.h>
+#include <signal.h>
 #include <re2/re2.h>
 
 using namespace llvm;
@@ -29,13 +44,25 @@ static cl::list<std::string> PathRemaps("remap",
                                         cl::value_desc("regex=replacement"));
 static cl::alias PathRemapsAlias("r", cl::aliasopt(PathRemaps));
 
-static cl::list<std::string> InputIndexPaths(cl::Positional, cl::OneOrMore,
-                                             cl::desc("<input-indexstores>"));
+// The input stores followed by the output store. These are optional so that
+// -explain can be used without them, and are checked in main otherwise.
+static cl::list<std::string>
+    IndexStorePaths(cl::Positional, cl::ZeroOrMore,
+                    cl::desc("<input-indexstores> <output-indexstore>"));
+
+// Set from IndexStorePaths.
+static std::vector<std::string> InputIndexPaths;
+static std::string OutputIndexPath;
 
 static cl::list<std::string> RemapFilePaths("import-output-file",
                                             cl::desc("import-output-file="));
-static cl::opt<std::string> OutputIndexPath(cl::Positional, cl::Required,
-                                            cl::desc("<output-indexstore>"));
+
+static cl::list<std::string> AdditionalOutputIndexPaths(
+    "output-store",
+    cl::desc("Additional output index store. Remaps given after an "
+             "-output-store flag apply only to that store, remaps given before "
+             "the first -output-store apply to <output-indexstore>"),
+    cl::value_desc("path"));
 
 static cl::list<std::string> FilePrefixMaps("file-prefix-map",
                                             cl::desc("file-prefix-map="));
@@ -56,28 +83,450 @@ static cl::opt<bool> UndoRulesSwiftRenames(
         "'__SPACE__'. Using this flag undoes that replacement, changing "
         "'__SPACE__' into ' '. This flag will be removed in the future."));
 
+static cl::opt<bool>
+    ImportStats("import-stats",
+                cl::desc("Print the number of units read and modified"));
+
+static cl::list<std::string> PriorityModules(
+    "priority-module",
+    cl::desc("Import units of this module, and their records, before all "
+             "other units"),
+    cl::value_desc("name"));
+
+static cl::list<std::string> PriorityMainFiles(
+    "priority-main-file",
+    cl::desc("Import units with this main file, after remapping, and their "
+             "records, before all other units"),
+    cl::value_desc("path"));
+
+static cl::opt<bool> PriorityRecent(
+    "priority-recent",
+    cl::desc("Import the most recently modified units of each input store "
+             "first"));
+
+static cl::opt<unsigned> PriorityRecentCount(
+    "priority-recent-count",
+    cl::desc("Import the <n> most recently modified units across all input "
+             "stores, and their records, before all other units"),
+    cl::value_desc("n"), cl::init(0));
+
+static cl::opt<bool> RemapProfiling(
+    "remap-profile",
+    cl::desc("Print match counts and time spent per remap rule, and the most "
+             "common prefixes of paths that no rule matched"));
+
+static cl::list<std::string>
+    ExplainPaths("explain",
+                 cl::desc("Print which remap rule rewrites the given path and "
+                          "the result, then exit without importing"),
+                 cl::value_desc("path"));
+
+// Statistics collected by -remap-profile. A single Remapper is shared by all
+// import workers, so these are updated concurrently.
+struct RemapProfile {
+  explicit RemapProfile(size_t numRules)
+      : ruleMatches(numRules), ruleNanoseconds(numRules) {}
+
+  // Unmatched paths are grouped by their directory, truncated to this many
+  // path components (including the root).
+  static constexpr size_t prefixDepth = 4;
+
+  void addUnmatched(StringRef path) {
+    StringRef parent = path::parent_path(path);
+    size_t prefixLength = 0;
+    auto component = path::begin(parent);
+    const auto end = path::end(parent);
+    for (size_t depth = 0; depth < prefixDepth && component != end;
+         ++depth, ++component) {
+      prefixLength = component->end() - parent.begin();
+    }
+
+    StringRef prefix = parent.substr(0, prefixLength);
+    if (prefix.empty()) {
+      prefix = ".";
+    }
+
+    this->unmatched++;
+    std::lock_guard<std::mutex> lock(this->unmatchedMutex);
+    this->unmatchedPrefixes[prefix]++;
+  }
+
+  std::vector<std::atomic<size_t>> ruleMatches;
+  std::vector<std::atomic<uint64_t>> ruleNanoseconds;
+  std::atomic<size_t> unmatched{0};
+  std::mutex unmatchedMutex;
+  StringMap<size_t> unmatchedPrefixes;
+};
+
 struct Remapper {
 public:
   std::string remap(const llvm::StringRef input) const {
+    return this->remap(input, this->_profile.get());
+  }
+
+  // Same as remap, but never recorded in the RemapProfile. Used for paths that
+  // are remapped only to make a decision, and not written to the output.
+  std::string remapUnprofiled(const llvm::StringRef input) const {
+    return this->remap(input, nullptr);
+  }
+
+  // Prints the first rule that rewrites `input`, and the resulting path.
+  void explain(const llvm::StringRef input, raw_ostream &os) const {
+    os << input << "\n";
+    for (size_t index = 0; index < this->_remaps.size(); ++index) {
+      std::string input_str = input.str();
+      const auto &remap = this->_remaps[index];
+      if (re2::RE2::Replace(&input_str, *remap.first, remap.second)) {
+        os << "  rule " << (index + 1) << ": '" << this->_rules[index]
+           << "'\n  result: "
+           << path::remove_leading_dotslash(StringRef(input_str)) << "\n";
+        return;
+      }
+    }
+
+    os << "  no rule matched\n  result: "
+       << path::remove_leading_dotslash(input) << "\n";
+  }
+
+  // `rule` is the -remap argument the pattern and replacement were parsed
+  // from, it is used when printing the rule.
+  void addRemap(std::shared_ptr<re2::RE2> &pattern,
+                const std::string &replacement, const std::string &rule) {
+    this->_remaps.emplace_back(pattern, replacement);
+    this->_rules.push_back(rule);
+  }
+
+  // Starts collecting a RemapProfile. Must be called after all rules are
+  // added.
+  void enableProfiling() {
+    this->_profile = std::make_shared<RemapProfile>(this->_remaps.size());
+  }
+
+  void printProfile(raw_ostream &os) const {
+    if (not this->_profile) {
+      return;
+    }
+
+    uint64_t totalNanoseconds = 0;
+    os << "Remap rules:\n";
+    for (size_t index = 0; index < this->_remaps.size(); ++index) {
+      const uint64_t nanoseconds = this->_profile->ruleNanoseconds[index];
+      totalNanoseconds += nanoseconds;
+      os << "  " << (index + 1) << ": "
+         << this->_profile->ruleMatches[index].load() << " matches, "
+         << format("%.3f", nanoseconds / 1e6) << "ms, '"
+         << this->_rules[index] << "'\n";
+    }
+    os << "Remap time: " << format("%.3f", totalNanoseconds / 1e6) << "ms\n";
+
+    // Sort the unmatched prefixes by descending count.
+    std::vector<std::pair<StringRef, size_t>> prefixes;
+    for (const auto &entry : this->_profile->unmatchedPrefixes) {
+      prefixes.emplace_back(entry.getKey(), entry.getValue());
+    }
+    std::sort(prefixes.begin(), prefixes.end(),
+              [](const auto &lhs, const auto &rhs) {
+                return lhs.second != rhs.second ? lhs.second > rhs.second
+                                                : lhs.first < rhs.first;
+              });
+
+    const size_t maxPrefixes = 10;
+    os << "Unmatched paths: " << this->_profile->unmatched.load() << "\n";
+    for (size_t index = 0; index < prefixes.size() && index < maxPrefixes;
+         ++index) {
+      os << "  " << prefixes[index].second << " " << prefixes[index].first
+         << "\n";
+    }
+  }
+
+private:
+  std::string remap(const llvm::StringRef input, RemapProfile *profile) const {
     std::string input_str = input.str();
-    for (const auto &remap : this->_remaps) {
-      const auto &pattern = remap.first;
-      const auto &replacement = remap.second;
-      if (re2::RE2::Replace(&input_str, *pattern, replacement)) {
+    for (size_t index = 0; index < this->_remaps.size(); ++index) {
+      if (this->replace(index, input_str, profile)) {
         return path::remove_leading_dotslash(StringRef(input_str)).str();
       }
     }
 
+    if (profile && !input.empty()) {
+      profile->addUnmatched(input);
+    }
+
     // No patterns matched, return the input unaltered.
     return path::remove_leading_dotslash(input).str();
   }
 
-  void addRemap(std::shared_ptr<re2::RE2> &pattern,
-                const std::string &replacement) {
-    this->_remaps.emplace_back(pattern, replacement);
+  // Applies the rule at `index` to `str`. When profiling, the match and the
+  // time spent in RE2::Replace are recorded.
+  bool replace(size_t index, std::string &str, RemapProfile *profile) const {
+    const auto &pattern = this->_remaps[index].first;
+    const auto &replacement = this->_remaps[index].second;
+    if (not profile) {
+      return re2::RE2::Replace(&str, *pattern, replacement);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const bool matched = re2::RE2::Replace(&str, *pattern, replacement);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    profile->ruleNanoseconds[index] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    if (matched) {
+      profile->ruleMatches[index]++;
+    }
+    return matched;
   }
 
   std::vector<std::pair<std::shared_ptr<re2::RE2>, std::string>> _remaps;
+  std::vector<std::string> _rules;
+  std::shared_ptr<RemapProfile> _profile;
+};
+
+// Counters reported by -import-stats. These are updated concurrently by the
+// parallel import workers.
+struct ImportCounters {
+  std::atomic<size_t> unitsRead{0};
+  std::atomic<size_t> unitsPriority{0};
+  std::atomic<size_t> unitsUpToDate{0};
+  std::atomic<size_t> unitsDuplicate{0};
+  std::atomic<size_t> unitsUnchanged{0};
+  std::atomic<size_t> unitsModified{0};
+};
+
+static ImportCounters Counters;
+
+// The output units claimed during this run. The same unit often appears in
+// many input stores, for example units of modules and .swiftinterface files
+// that every target depends on. Each output unit is imported by the first
+// worker to claim it, and all other copies are skipped once it has been
+// installed. If the import fails, the claim is released and the next copy is
+// imported instead.
+//
+// When input stores are processed serially, the copy from the first input
+// store that has the unit is the one imported. Before claims, every copy was
+// written and the last one won.
+struct UnitClaims {
+  // Returns true if the caller must import `unitPath`, and then call
+  // `finish`. Returns false if another copy has already been installed. While
+  // another worker is importing the same unit, this waits for it to finish.
+  bool claim(StringRef unitPath) {
+    std::unique_lock<std::mutex> lock(this->_mutex);
+    while (true) {
+      auto inserted = this->_claims.try_emplace(unitPath, State::Importing);
+      if (inserted.second) {
+        return true;
+      }
+      if (inserted.first->second == State::Imported) {
+        return false;
+      }
+      this->_finished.wait(lock);
+    }
+  }
+
+  // Ends a claim. If `imported` is false, the unit can be claimed again.
+  void finish(StringRef unitPath, bool imported) {
+    {
+      std::lock_guard<std::mutex> lock(this->_mutex);
+      if (imported) {
+        this->_claims[unitPath] = State::Imported;
+      } else {
+        this->_claims.erase(unitPath);
+      }
+    }
+    this->_finished.notify_all();
+  }
+
+private:
+  enum class State { Importing, Imported };
+
+  std::mutex _mutex;
+  std::condition_variable _finished;
+  StringMap<State> _claims;
+};
+
+static UnitClaims Claims;
+
+static int64_t toNanoseconds(sys::TimePoint<> time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+// Metadata about the units installed in an output store, kept in the file
+// "index-import-metadata" of the store. For each unit it records the size and
+// hash of its contents, its mtime, and the mtime of the input unit it was
+// imported from. An entry is only trusted while the unit still has the
+// recorded mtime, which catches units rewritten by other tools.
+//
+// Unchanged units are not rewritten, so their mtime can be older than their
+// input unit. The metadata lets -incremental treat them as up to date anyway.
+struct UnitMetadata {
+  struct Entry {
+    uint64_t size;
+    uint64_t hash;
+    int64_t unitModified;
+    int64_t inputModified;
+  };
+
+  // Loads the metadata file, if there is one. Malformed lines are ignored.
+  void load(StringRef path) {
+    auto buffer = MemoryBuffer::getFile(path);
+    if (not buffer) {
+      return;
+    }
+
+    SmallVector<StringRef, 0> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, /*KeepEmpty*/ false);
+    if (lines.empty() || lines[0] != FormatVersion) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    for (StringRef line : ArrayRef<StringRef>(lines).drop_front()) {
+      // Unit names can contain spaces, so the name is the last field.
+      Entry entry;
+      StringRef size, hash, unitModified, inputModified;
+      std::tie(size, line) = line.split(' ');
+      std::tie(hash, line) = line.split(' ');
+      std::tie(unitModified, line) = line.split(' ');
+      std::tie(inputModified, line) = line.split(' ');
+      if (size.getAsInteger(10, entry.size) ||
+          hash.getAsInteger(16, entry.hash) ||
+          unitModified.getAsInteger(10, entry.unitModified) ||
+          inputModified.getAsInteger(10, entry.inputModified) ||
+          line.empty()) {
+        continue;
+      }
+      this->_entries[line] = entry;
+    }
+  }
+
+  // Saves the metadata, merged with the entries saved by concurrent imports
+  // into the same store since it was loaded. Entries updated by this import
+  // take precedence. Entries of units that are no longer in `unitsPath` are
+  // dropped, so the file doesn't grow with units that were removed.
+  bool save(StringRef path, StringRef unitsPath, std::string &error) const {
+    // Saves are serialized across processes with a lock file next to the
+    // metadata file.
+    const std::string lockPath = (path + ".lock").str();
+    int lockFD;
+    if (std::error_code ec = fs::openFileForReadWrite(
+            lockPath, lockFD, fs::CD_OpenAlways, fs::OF_None)) {
+      error = "could not open '" + lockPath + "': " + ec.message();
+      return false;
+    }
+    auto closeLock = make_scope_exit([&] { fs::closeFile(lockFD); });
+    if (std::error_code ec = fs::lockFile(lockFD)) {
+      error = "could not lock '" + lockPath + "': " + ec.message();
+      return false;
+    }
+    auto unlock = make_scope_exit([&] { fs::unlockFile(lockFD); });
+
+    UnitMetadata saved;
+    saved.load(path);
+
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    for (const auto &item : this->_updated) {
+      saved._entries[item.getKey()] = this->_entries.lookup(item.getKey());
+    }
+
+    std::vector<std::string> removedUnits;
+    for (const auto &item : saved._entries) {
+      SmallString<256> unitPath;
+      path::append(unitPath, unitsPath, item.getKey());
+      if (not fs::exists(unitPath)) {
+        removedUnits.push_back(item.getKey().str());
+      }
+    }
+    for (const auto &removedUnit : removedUnits) {
+      saved._entries.erase(removedUnit);
+    }
+
+    Error failed = writeToOutput(path, [&](raw_ostream &os) {
+      os << FormatVersion << "\n";
+      for (const auto &item : saved._entries) {
+        const Entry &entry = item.getValue();
+        os << entry.size << " " << format_hex_no_prefix(entry.hash, 16) << " "
+           << entry.unitModified << " " << entry.inputModified << " "
+           << item.getKey() << "\n";
+      }
+      return Error::success();
+    });
+    if (failed) {
+      error = toString(std::move(failed));
+      return false;
+    }
+    return true;
+  }
+
+  // Returns the entry for the unit, if the unit still has the recorded size
+  // and mtime.
+  std::optional<Entry> lookup(StringRef unitName,
+                              const fs::file_status &unitStatus) const {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    auto found = this->_entries.find(unitName);
+    if (found == this->_entries.end()) {
+      return std::nullopt;
+    }
+
+    const Entry &entry = found->getValue();
+    if (entry.size != unitStatus.getSize() ||
+        entry.unitModified !=
+            toNanoseconds(unitStatus.getLastModificationTime())) {
+      return std::nullopt;
+    }
+    return entry;
+  }
+
+  void update(StringRef unitName, const Entry &entry) {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    this->_entries[unitName] = entry;
+    this->_updated.insert(unitName);
+  }
+
+  // Returns true if the unit was installed or found unchanged by an import of
+  // an input unit that is at least as new as `inputUnitPath`.
+  bool isUpToDate(StringRef unitPath, StringRef inputUnitPath) const {
+    fs::file_status unitStatus;
+    fs::file_status inputStatus;
+    if (fs::status(unitPath, unitStatus) ||
+        fs::status(inputUnitPath, inputStatus)) {
+      return false;
+    }
+
+    auto entry = this->lookup(path::filename(unitPath), unitStatus);
+    return entry.has_value() &&
+           toNanoseconds(inputStatus.getLastModificationTime()) <=
+               entry->inputModified;
+  }
+
+  static constexpr const char *FileName = "index-import-metadata";
+
+private:
+  static constexpr const char *FormatVersion = "index-import-metadata v1";
+
+  mutable std::mutex _mutex;
+  StringMap<Entry> _entries;
+  // The entries updated by this import, see save.
+  StringSet<> _updated;
+};
+
+// An output index store, along with the remaps used for units imported into
+// it. Every input unit is read once and then imported into each OutputStore.
+struct OutputStore {
+  explicit OutputStore(StringRef storePath) : path(storePath.str()) {
+    path::append(this->unitsPath, storePath, "v5", "units");
+    path::append(this->recordsPath, storePath, "v5", "records");
+  }
+
+  std::string path;
+  SmallString<256> unitsPath;
+  SmallString<256> recordsPath;
+  // Units are written here first, see installStagedUnit.
+  std::string stagingPath;
+  SmallString<256> stagingUnitsPath;
+  Remapper remapper;
+  // Shared, because workers import into the store concurrently.
+  std::shared_ptr<UnitMetadata> metadata = std::make_shared<UnitMetadata>();
 };
 
 // Helper for working with index::writer::OpaqueModule. Provides the following:
@@ -221,13 +670,121 @@ static bool cloneRecord(StringRef from, StringRef to) {
   return (!failed || errno == EEXIST);
 }
 
-// Returns None if the Unit file is already up to date
+// Hard links `to` to a record that was already transferred to `linkFrom`, to
+// avoid copying the same record into every output store. Falls back to
+// copying from `from`, for example when the stores are on different volumes.
+static bool linkOrCloneRecord(StringRef from, StringRef linkFrom,
+                              StringRef to) {
+  if (fs::exists(to)) {
+    return true;
+  }
+
+  if (not fs::create_hard_link(linkFrom, to)) {
+    return true;
+  }
+
+  return cloneRecord(from, to);
+}
+
+// Returns true if the file at `path` has exactly the given contents. Sizes
+// are compared first, so most changed units are detected without reading the
+// file.
+static bool hasContents(StringRef path, StringRef contents) {
+  uint64_t size;
+  if (fs::file_size(path, size) || size != contents.size()) {
+    return false;
+  }
+
+  auto buffer = MemoryBuffer::getFile(path);
+  return buffer && (*buffer)->getBuffer() == contents;
+}
+
+// Moves a unit from the staging store into the output store. If the output
+// store already has an identical unit, the staged unit is discarded instead,
+// which leaves the existing file and its mtime untouched. Xcode uses the mtime
+// to decide which units to re-ingest.
+//
+// The existing unit is compared by the size and hash recorded in the store's
+// metadata, and is only read when it has no valid metadata entry. Either way,
+// the metadata is updated for the unit.
+//
+// Returns true if the output unit was modified, false if it was unchanged, and
+// None on error.
+static std::optional<bool>
+installStagedUnit(StringRef stagedUnitPath, StringRef outputUnitPath,
+                  StringRef inputUnitPath, UnitMetadata &metadata,
+                  std::string &error) {
+  auto staged = MemoryBuffer::getFile(stagedUnitPath);
+  if (not staged) {
+    llvm::raw_string_ostream err(error);
+    err << "could not read '" << stagedUnitPath
+        << "': " << staged.getError().message();
+    return std::nullopt;
+  }
+
+  const StringRef contents = (*staged)->getBuffer();
+  const StringRef unitName = path::filename(outputUnitPath);
+  UnitMetadata::Entry entry;
+  entry.size = contents.size();
+  entry.hash = xxh3_64bits(contents);
+
+  bool unchanged = false;
+  fs::file_status outputStatus;
+  if (not fs::status(outputUnitPath, outputStatus)) {
+    if (auto existing = metadata.lookup(unitName, outputStatus)) {
+      unchanged = existing->size == entry.size && existing->hash == entry.hash;
+    } else {
+      unchanged = hasContents(outputUnitPath, contents);
+    }
+  }
+  staged->reset();
+
+  if (unchanged) {
+    fs::remove(stagedUnitPath);
+  } else {
+    if (std::error_code ec = fs::rename(stagedUnitPath, outputUnitPath)) {
+      llvm::raw_string_ostream err(error);
+      err << "could not move '" << stagedUnitPath << "' to '"
+          << outputUnitPath << "': " << ec.message();
+      return std::nullopt;
+    }
+    if (std::error_code ec = fs::status(outputUnitPath, outputStatus)) {
+      llvm::raw_string_ostream err(error);
+      err << "could not access path '" << outputUnitPath
+          << "': " << ec.message();
+      return std::nullopt;
+    }
+  }
+
+  fs::file_status inputStatus;
+  if (not fs::status(inputUnitPath, inputStatus)) {
+    entry.unitModified = toNanoseconds(outputStatus.getLastModificationTime());
+    entry.inputModified = toNanoseconds(inputStatus.getLastModificationTime());
+    metadata.update(unitName, entry);
+  }
+
+  return not unchanged;
+}
+
+// Returns None if the Unit file is already up to date, or if another copy of
+// the same unit has already been imported by this run. The returned writer
+// writes into the staging store of `output`, and `unitName` is set to the
+// file name of the unit it writes. The caller must end the unit's claim with
+// `Claims.finish`.
+//
+// When `cloneDepRecords` is set, the unit's records are copied from
+// `inputRecordsPath`, or linked from `linkRecordsPath` if it is non-empty.
 static std::optional<IndexUnitWriter>
-importUnit(StringRef outputUnitsPath, StringRef inputUnitPath,
-           StringRef outputRecordsPath, StringRef inputRecordsPath,
+importUnit(const OutputStore &output, StringRef inputUnitPath,
+           bool cloneDepRecords, StringRef inputRecordsPath,
+           StringRef linkRecordsPath,
            const std::unique_ptr<IndexUnitReader> &reader,
-           const Remapper &remapper, const PathRemapper &clangPathRemapper,
-           FileManager &fileMgr, ModuleNameScope &moduleNames) {
+           const PathRemapper &clangPathRemapper, FileManager &fileMgr,
+           ModuleNameScope &moduleNames, SmallVectorImpl<char> &unitName) {
+  const auto &remapper = output.remapper;
+  const StringRef outputUnitsPath = output.unitsPath;
+  const StringRef outputRecordsPath = output.recordsPath;
+
   // The set of remapped paths.
   auto workingDir = remapper.remap(reader->getWorkingDirectory());
 
@@ -243,9 +800,6 @@ importUnit(StringRef outputUnitsPath, StringRef inputUnitPath,
   }
   auto outputFile = remapper.remap(originalOutputFilePath);
 
-  // Cloning records when we've got an output records path
-  const auto cloneDepRecords = !outputRecordsPath.empty();
-
   if (Incremental) {
     // Check if the unit file is already up to date
     SmallString<256> remappedOutputFilePath;
@@ -255,25 +809,42 @@ importUnit(StringRef outputUnitsPath, StringRef inputUnitPath,
     } else {
       remappedOutputFilePath = outputFile;
     }
+    SmallString<256> existingUnitPath;
+    getUnitPathForOutputFile(outputUnitsPath, remappedOutputFilePath,
+                             existingUnitPath, clangPathRemapper, fileMgr);
     if (isUnitUpToDate(outputUnitsPath, remappedOutputFilePath, inputUnitPath,
-                       clangPathRemapper, fileMgr)) {
+                       clangPathRemapper, fileMgr) ||
+        output.metadata->isUpToDate(existingUnitPath, inputUnitPath)) {
+      Counters.unitsUpToDate++;
       return std::nullopt;
     }
   }
 
-  auto mainFilePath = remapper.remap(reader->getMainFilePath());
-  auto sysrootPath = remapper.remap(reader->getSysrootPath());
-
+  // IndexUnitWriter has special logic for empty working directories meaning
+  // the current working directory. IndexUnitWriter also always makes paths
+  // absolute, so not doing this results in an odd "." in the path. The
+  // working directory is always assigned, because the FileManager is reused
+  // for other units and output stores.
   auto &fsOpts = fileMgr.getFileSystemOpts();
-  if (workingDir != ".") {
-    // IndexUnitWriter has special logic for empty working directories meaning
-    // the current working directory. IndexUnitWriter also always makes paths
-    // absolute, so not doing this results in an odd "." in the path.
-    fsOpts.WorkingDir = workingDir;
+  fsOpts.WorkingDir = (workingDir != ".") ? workingDir : "";
+
+  // Duplicates are skipped before any other work. With the working directory
+  // assigned, this computes the same unit name as IndexUnitWriter.
+  SmallString<256> outputUnitPath;
+  getUnitPathForOutputFile(outputUnitsPath, outputFile, outputUnitPath,
+                           clangPathRemapper, fileMgr);
+  if (not Claims.claim(outputUnitPath)) {
+    Counters.unitsDuplicate++;
+    return std::nullopt;
   }
+  const StringRef outputUnitName = path::filename(outputUnitPath);
+  unitName.assign(outputUnitName.begin(), outputUnitName.end());
+
+  auto mainFilePath = remapper.remap(reader->getMainFilePath());
+  auto sysrootPath = remapper.remap(reader->getSysrootPath());
 
   auto writer = IndexUnitWriter(
-      fileMgr, OutputIndexPath, reader->getProviderIdentifier(),
+      fileMgr, output.stagingPath, reader->getProviderIdentifier(),
       reader->getProviderVersion(), outputFile, reader->getModuleName(),
       getFileEntryRef(fileMgr, mainFilePath), reader->isSystemUnit(),
       reader->isModuleUnit(), reader->isDebugCompilation(), reader->getTarget(),
@@ -323,7 +894,16 @@ importUnit(StringRef outputUnitsPath, StringRef inputUnitPath,
         }
         sys::path::append(inputRecordPath, inputRecordsPath);
         appendInteriorRecordPath(info.UnitOrRecordName, inputRecordPath);
-        cloneRecord(StringRef(inputRecordPath), StringRef(outputRecordPath));
+        if (linkRecordsPath.empty()) {
+          cloneRecord(StringRef(inputRecordPath), StringRef(outputRecordPath));
+        } else {
+          SmallString<128> linkRecordPath;
+          sys::path::append(linkRecordPath, linkRecordsPath);
+          appendInteriorRecordPath(info.UnitOrRecordName, linkRecordPath);
+          linkOrCloneRecord(StringRef(inputRecordPath),
+                            StringRef(linkRecordPath),
+                            StringRef(outputRecordPath));
+        }
       }
       writer.addRecordFile(name, file, isSystem, moduleNameRef);
       break;
@@ -347,9 +927,11 @@ importUnit(StringRef outputUnitsPath, StringRef inputUnitPath,
   return writer;
 }
 
+// Clones all records of the input store into every output store. Records are
+// copied into the first output store, and linked from there into the others.
 static bool cloneRecords(StringRef recordsDirectory,
                          const std::string &inputIndexPath,
-                         const std::string &outputIndexPath) {
+                         const std::vector<OutputStore> &outputs) {
   bool success = true;
 
   std::error_code dirError;
@@ -365,21 +947,33 @@ static bool cloneRecords(StringRef recordsDirectory,
     }
 
     auto inputPath = dir->path();
-    SmallString<128> outputPath{inputPath};
-    path::replace_path_prefix(outputPath, inputIndexPath, outputIndexPath);
-
-    if (status->type() == fs::file_type::directory_file) {
-      std::error_code failed = fs::create_directory(outputPath);
-      if (failed && failed != std::errc::file_exists) {
-        success = false;
-        errs() << "Could not create directory `" << outputPath
-               << "`: " << failed.message() << "\n";
+    SmallString<128> firstOutputPath;
+    for (const auto &output : outputs) {
+      SmallString<128> outputPath{inputPath};
+      path::replace_path_prefix(outputPath, inputIndexPath, output.path);
+
+      if (status->type() == fs::file_type::directory_file) {
+        std::error_code failed = fs::create_directory(outputPath);
+        if (failed && failed != std::errc::file_exists) {
+          success = false;
+          errs() << "Could not create directory `" << outputPath
+                 << "`: " << failed.message() << "\n";
+        }
+      } else if (status->type() == fs::file_type::regular_file) {
+        const bool cloned =
+            firstOutputPath.empty()
+                ? cloneRecord(inputPath, outputPath)
+                : linkOrCloneRecord(inputPath, firstOutputPath, outputPath);
+        if (not cloned) {
+          success = false;
+          errs() << "Could not copy record file from `" << inputPath
+                 << "` to `" << outputPath << "`: " << strerror(errno)
+                 << "\n";
+        }
       }
-    } else if (status->type() == fs::file_type::regular_file) {
-      if (not cloneRecord(inputPath, outputPath)) {
-        success = false;
-        errs() << "Could not copy record file from `" << inputPath << "` to `"
-               << outputPath << "`: " << strerror(errno) << "\n";
+
+      if (firstOutputPath.empty()) {
+        firstOutputPath = outputPath;
       }
     }
   }
@@ -403,18 +997,124 @@ static std::string normalizePath(StringRef Path) {
   return NormalizedPath.str().str();
 }
 
-static bool remapIndex(const Remapper &remapper,
-                       const PathRemapper &clangPathRemapper,
+// The units of an input store that remapIndex imports. Imports that use the
+// -priority-module or -priority-main-file flags run in two waves over all
+// input stores. The first wave makes the units developers care about usable
+// early, the second wave imports everything else.
+enum class ImportWave {
+  // All units, and all records of the store.
+  All,
+  // Only the priority units, and the records they reference. All other units
+  // are deferred.
+  Priority,
+  // The units deferred by the Priority wave, and all records of the store.
+  Deferred,
+};
+
+static bool hasPriorityUnits() {
+  return not PriorityModules.empty() || not PriorityMainFiles.empty() ||
+         PriorityRecentCount != 0;
+}
+
+// The paths of the units selected by -priority-recent-count. This is filled in
+// before the Priority wave, and only read during it.
+static StringSet<> RecentUnitPaths;
+
+// Returns true if the unit is one of the RecentUnitPaths, or matches a
+// -priority-module or -priority-main-file flag. Main files are compared after
+// remapping for the first output store. This remapping isn't part of the
+// import, so it isn't profiled.
+static bool isPriorityUnit(StringRef unitPath,
+                           const std::unique_ptr<IndexUnitReader> &reader,
+                           const Remapper &remapper) {
+  if (RecentUnitPaths.contains(unitPath) ||
+      is_contained(PriorityModules, reader->getModuleName())) {
+    return true;
+  }
+
+  if (PriorityMainFiles.empty() || reader->getMainFilePath().empty()) {
+    return false;
+  }
+  return is_contained(PriorityMainFiles,
+                      remapper.remapUnprofiled(reader->getMainFilePath()));
+}
+
+// Sorts unit paths so that the most recently modified units come first.
+static void sortByMostRecent(std::vector<std::string> &unitPaths) {
+  std::vector<std::pair<sys::TimePoint<>, std::string>> timedPaths;
+  timedPaths.reserve(unitPaths.size());
+  for (auto &unitPath : unitPaths) {
+    fs::file_status status;
+    sys::TimePoint<> modified;
+    if (not fs::status(unitPath, status)) {
+      modified = status.getLastModificationTime();
+    }
+    timedPaths.emplace_back(modified, std::move(unitPath));
+  }
+
+  std::stable_sort(
+      timedPaths.begin(), timedPaths.end(),
+      [](const auto &lhs, const auto &rhs) { return lhs.first > rhs.first; });
+
+  for (size_t index = 0; index < unitPaths.size(); ++index) {
+    unitPaths[index] = std::move(timedPaths[index].second);
+  }
+}
+
+// Fills RecentUnitPaths with the -priority-recent-count most recently modified
+// units of all input stores. Unit paths are built the same way as remapIndex
+// builds them, so that they can be compared.
+static void collectRecentUnitPaths() {
+  using TimedPath = std::pair<sys::TimePoint<>, std::string>;
+  std::vector<std::vector<TimedPath>> storePaths(InputIndexPaths.size());
+  auto *paths = storePaths.data();
+
+  dispatch_apply(storePaths.size(), DISPATCH_APPLY_AUTO, ^(size_t index) {
+    SmallString<256> unitDirectory;
+    path::append(unitDirectory, normalizePath(InputIndexPaths[index]), "v5",
+                 "units");
+
+    // Errors are reported when the store is imported.
+    std::error_code dirError;
+    fs::directory_iterator dir{unitDirectory, dirError};
+    fs::directory_iterator end;
+    for (; dir != end && !dirError; dir.increment(dirError)) {
+      fs::file_status status;
+      if (not fs::status(dir->path(), status)) {
+        paths[index].emplace_back(status.getLastModificationTime(),
+                                  dir->path());
+      }
+    }
+  });
+
+  std::vector<TimedPath> timedPaths;
+  for (auto &store : storePaths) {
+    std::move(store.begin(), store.end(), std::back_inserter(timedPaths));
+  }
+
+  const size_t count = std::min<size_t>(PriorityRecentCount, timedPaths.size());
+  std::nth_element(
+      timedPaths.begin(), timedPaths.begin() + count, timedPaths.end(),
+      [](const auto &lhs, const auto &rhs) { return lhs.first > rhs.first; });
+  for (size_t index = 0; index < count; ++index) {
+    RecentUnitPaths.insert(timedPaths[index].second);
+  }
+}
+
+// Imports units of the input store, according to `wave`. The Priority wave
+// adds the paths of units it skips to `deferredUnitPaths`, in import order,
+// which are then read again and imported by the Deferred wave. Only the paths
+// are kept, holding every parsed unit in memory until then would not scale to
+// large stores.
+static bool remapIndex(const PathRemapper &clangPathRemapper,
                        const std::string &InputIndexPath,
-                       const std::string &outputIndexPath) {
+                       const std::vector<OutputStore> &outputs,
+                       ImportWave wave,
+                       std::vector<std::string> &deferredUnitPaths) {
   SmallString<256> unitDirectory;
   path::append(unitDirectory, InputIndexPath, "v5", "units");
   SmallString<256> recordsDirectory;
   path::append(recordsDirectory, InputIndexPath, "v5", "records");
-  SmallString<256> outputUnitDirectory;
-  path::append(outputUnitDirectory, OutputIndexPath, "v5", "units");
-  SmallString<256> outputRecordsDirectory;
-  path::append(outputRecordsDirectory, OutputIndexPath, "v5", "records");
 
   if (not fs::is_directory(unitDirectory)) {
     errs() << "error: invalid index store directory " << InputIndexPath << "\n";
@@ -423,8 +1123,7 @@ static bool remapIndex(const Remapper &remapper,
 
   bool success = true;
 
-  auto handleUnitPath = [&](StringRef unitPath, StringRef outputRecordsPath_,
-                            FileManager &fileManager) {
+  auto readUnit = [&](StringRef unitPath) {
     std::string unitReadError;
     auto reader = IndexUnitReader::createWithFilePath(
         unitPath, clangPathRemapper, unitReadError);
@@ -432,20 +1131,59 @@ static bool remapIndex(const Remapper &remapper,
       errs() << "error: failed to read unit file " << unitPath << " -- "
              << unitReadError << "\n";
       success = false;
-      return;
     }
+    return reader;
+  };
+
+  auto importReader = [&](StringRef unitPath,
+                          const std::unique_ptr<IndexUnitReader> &reader,
+                          bool cloneDepRecords, FileManager &fileManager) {
+    Counters.unitsRead++;
+
+    // The parsed unit is shared by all output stores, only the remapping and
+    // writing is done per store.
+    for (size_t index = 0; index < outputs.size(); ++index) {
+      const auto &output = outputs[index];
+      const StringRef linkRecordsPath =
+          (index == 0) ? StringRef() : StringRef(outputs[0].recordsPath);
 
-    ModuleNameScope moduleNames;
-    auto writer = importUnit(outputUnitDirectory, unitPath, outputRecordsPath_,
-                             recordsDirectory, reader, remapper,
-                             clangPathRemapper, fileManager, moduleNames);
+      ModuleNameScope moduleNames;
+      SmallString<128> unitName;
+      auto writer = importUnit(output, unitPath, cloneDepRecords,
+                               recordsDirectory, linkRecordsPath, reader,
+                               clangPathRemapper, fileManager, moduleNames,
+                               unitName);
+      if (not writer.has_value()) {
+        continue;
+      }
+
+      SmallString<256> stagedUnitPath;
+      path::append(stagedUnitPath, output.stagingUnitsPath, unitName);
+      SmallString<256> outputUnitPath;
+      path::append(outputUnitPath, output.unitsPath, unitName);
 
-    if (writer.has_value()) {
       std::string unitWriteError;
       if (writer->write(unitWriteError)) {
         errs() << "error: failed to write index store; " << unitWriteError
                << "\n";
+        Claims.finish(outputUnitPath, /*imported*/ false);
+        success = false;
+        continue;
+      }
+
+      std::string installError;
+      auto modified = installStagedUnit(stagedUnitPath, outputUnitPath,
+                                        unitPath, *output.metadata,
+                                        installError);
+      Claims.finish(outputUnitPath, modified.has_value());
+      if (not modified.has_value()) {
+        errs() << "error: failed to write index store; " << installError
+               << "\n";
         success = false;
+      } else if (*modified) {
+        Counters.unitsModified++;
+      } else {
+        Counters.unitsUnchanged++;
       }
     }
   };
@@ -458,60 +1196,276 @@ static bool remapIndex(const Remapper &remapper,
       SmallString<256> outPath;
       getUnitPathForOutputFile(unitDirectory, normalizePath(path), outPath,
                                clangPathRemapper, fileMgr);
-      handleUnitPath(outPath.c_str(), outputRecordsDirectory, fileMgr);
+      auto reader = readUnit(outPath);
+      if (reader) {
+        importReader(outPath, reader, /*cloneDepRecords*/ true, fileMgr);
+      }
     }
     return success;
   }
 
   // This batch clones records in the entire index. If we're importing
-  // individual ouput files we don't want this.
-  if (fs::exists(recordsDirectory)) {
-    if (not cloneRecords(recordsDirectory, InputIndexPath, outputIndexPath)) {
+  // individual ouput files we don't want this. The Priority wave clones only
+  // the records of the units it imports.
+  if (wave != ImportWave::Priority && fs::exists(recordsDirectory)) {
+    if (not cloneRecords(recordsDirectory, InputIndexPath, outputs)) {
       success = false;
     }
   }
 
-  // Process and map the entire index directory
-  std::error_code dirError;
-  fs::directory_iterator dir{unitDirectory, dirError};
-  fs::directory_iterator end;
   std::vector<std::string> unitPaths;
+  if (wave == ImportWave::Deferred) {
+    // Already in import order.
+    unitPaths = std::move(deferredUnitPaths);
+  } else {
+    // Process and map the entire index directory
+    std::error_code dirError;
+    fs::directory_iterator dir{unitDirectory, dirError};
+    fs::directory_iterator end;
+
+    // collect all unit paths
+    while (dir != end && !dirError) {
+      const auto unitPath = dir->path();
+      dir.increment(dirError);
+      unitPaths.push_back(unitPath);
+    }
 
-  // collect all unit paths
-  while (dir != end && !dirError) {
-    const auto unitPath = dir->path();
-    dir.increment(dirError);
-    unitPaths.push_back(unitPath);
-  }
+    if (dirError) {
+      errs() << "error: aborted while reading from unit directory: "
+             << dirError.message() << "\n";
+      success = false;
+    }
 
-  if (dirError) {
-    errs() << "error: aborted while reading from unit directory: "
-           << dirError.message() << "\n";
-    success = false;
+    if (PriorityRecent) {
+      sortByMostRecent(unitPaths);
+    }
   }
 
   const size_t length = unitPaths.size();
+  if (length == 0) {
+    return success;
+  }
+
   const size_t stride = (ParallelStride != 0) ? ParallelStride : length;
   const size_t numStrides = ((length - 1) / stride) + 1;
+  const bool isPriorityWave = (wave == ImportWave::Priority);
+  const std::string *paths = unitPaths.data();
+
+  // Units skipped by the Priority wave are stored by index, which keeps them
+  // in import order without locking.
+  std::vector<std::string> skippedPaths(isPriorityWave ? length : 0);
+  std::string *skipped = skippedPaths.data();
 
   dispatch_apply(numStrides, DISPATCH_APPLY_AUTO, ^(size_t strideIndex) {
     const size_t start = strideIndex * stride;
     const size_t end = std::min(start + stride, length);
-    std::vector<std::string> pathsToHandle(unitPaths.begin() + start,
-                                           unitPaths.begin() + end);
     FileSystemOptions fsOpts;
     FileManager fileMgr{fsOpts};
-    for (const auto &pathToHandle : pathsToHandle) {
-      handleUnitPath(pathToHandle, "", fileMgr);
+    for (size_t index = start; index < end; ++index) {
+      auto reader = readUnit(paths[index]);
+      if (not reader) {
+        continue;
+      }
+
+      if (isPriorityWave) {
+        if (not isPriorityUnit(paths[index], reader, outputs[0].remapper)) {
+          skipped[index] = paths[index];
+          continue;
+        }
+        Counters.unitsPriority++;
+      }
+
+      importReader(paths[index], reader, /*cloneDepRecords*/ isPriorityWave,
+                   fileMgr);
     }
   });
+
+  for (auto &skippedPath : skippedPaths) {
+    if (not skippedPath.empty()) {
+      deferredUnitPaths.push_back(std::move(skippedPath));
+    }
+  }
+  return success;
+}
+
+// Runs one wave of remapIndex over all input stores. `deferredUnitPaths` has
+// one entry per input store.
+static bool
+remapIndexes(const PathRemapper &clangPathRemapper,
+             const std::vector<OutputStore> &outputs, ImportWave wave,
+             std::vector<std::vector<std::string>> &deferredUnitPaths) {
+  if (ParallelStride == 0 || ParallelStride >= InputIndexPaths.size()) {
+    bool success = true;
+    for (size_t index = 0; index < InputIndexPaths.size(); ++index) {
+      auto &InputIndexPath = InputIndexPaths[index];
+      InputIndexPath = normalizePath(InputIndexPath);
+      if (not remapIndex(clangPathRemapper, InputIndexPath, outputs, wave,
+                         deferredUnitPaths[index])) {
+        success = false;
+      }
+    }
+    return success;
+  }
+
+  // Process the data stores in groups according to the parallel stride.
+  const size_t stride = static_cast<size_t>(ParallelStride);
+  const size_t length = InputIndexPaths.size();
+  const size_t numStrides = ((length - 1) / stride) + 1;
+  auto *deferred = deferredUnitPaths.data();
+
+  __block bool success = true;
+  dispatch_apply(numStrides, DISPATCH_APPLY_AUTO, ^(size_t strideIndex) {
+    const size_t start = strideIndex * stride;
+    const size_t end = std::min(start + stride, length);
+    for (size_t index = start; index < end; ++index) {
+      std::string InputIndexPath = normalizePath(InputIndexPaths[index]);
+      if (not remapIndex(clangPathRemapper, InputIndexPath, outputs, wave,
+                         deferred[index])) {
+        success = false;
+      }
+    }
+  });
+
+  return success;
+}
+
+static bool importIndexes(const PathRemapper &clangPathRemapper,
+                          const std::vector<OutputStore> &outputs) {
+  std::vector<std::vector<std::string>> deferredUnitPaths(
+      InputIndexPaths.size());
+
+  // Priority doesn't apply when importing individual output files.
+  if (not hasPriorityUnits() || RemapFilePaths.size()) {
+    return remapIndexes(clangPathRemapper, outputs, ImportWave::All,
+                        deferredUnitPaths);
+  }
+
+  if (PriorityRecentCount != 0) {
+    collectRecentUnitPaths();
+  }
+
+  // The first wave must be complete across all input stores before the second
+  // wave starts.
+  bool success = remapIndexes(clangPathRemapper, outputs, ImportWave::Priority,
+                              deferredUnitPaths);
+  if (not remapIndexes(clangPathRemapper, outputs, ImportWave::Deferred,
+                       deferredUnitPaths)) {
+    success = false;
+  }
   return success;
 }
 
+static void printImportStats(size_t numOutputs) {
+  const size_t unitsRead = Counters.unitsRead.load();
+  const size_t unitsDuplicate = Counters.unitsDuplicate.load();
+  // Every unit read is imported once per output store.
+  const size_t unitImports = unitsRead * numOutputs;
+  const double dedupeRatio =
+      unitImports ? 100.0 * unitsDuplicate / unitImports : 0.0;
+
+  outs() << "Units read: " << unitsRead << "\n"
+         << "Units prioritized: " << Counters.unitsPriority.load() << "\n"
+         << "Units up-to-date: " << Counters.unitsUpToDate.load() << "\n"
+         << "Units duplicate: " << unitsDuplicate << " ("
+         << format("%.1f", dedupeRatio) << "%)\n"
+         << "Units unchanged: " << Counters.unitsUnchanged.load() << "\n"
+         << "Units modified: " << Counters.unitsModified.load() << "\n";
+}
+
+// Staging stores are created inside the output store, with this prefix.
+// The prefix is followed by the ID of the process that owns the staging store.
+static const char *const StagingPrefix = "index-import-staging-";
+
+// Returns true if `stagingName` is the name of a staging store whose process
+// no longer exists.
+static bool isStaleStagingStore(StringRef stagingName) {
+  if (not stagingName.consume_front(StagingPrefix)) {
+    return false;
+  }
+
+  StringRef pidString = stagingName.split('-').first;
+  pid_t pid;
+  if (pidString.getAsInteger(10, pid) || pid <= 0) {
+    return false;
+  }
+
+  // EPERM means the process exists, but belongs to another user.
+  return ::kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+// Removes staging stores left behind by imports that didn't exit normally, for
+// example when they crashed or were killed. Staging stores of imports that are
+// still running, including concurrent imports into the same output store, are
+// left alone.
+static void removeStaleStagingStores(StringRef outputIndexPath) {
+  std::vector<std::string> stalePaths;
+  std::error_code dirError;
+  fs::directory_iterator dir{outputIndexPath, dirError};
+  fs::directory_iterator end;
+  for (; dir != end && !dirError; dir.increment(dirError)) {
+    if (dir->type() == fs::file_type::directory_file &&
+        isStaleStagingStore(path::filename(dir->path()))) {
+      stalePaths.push_back(dir->path());
+    }
+  }
+
+  for (const auto &stalePath : stalePaths) {
+    fs::remove_directories(stalePath);
+  }
+}
+
+// Initializes the output store, and creates the staging store that units are
+// written to before being moved into the output store.
+static bool initOutputStore(OutputStore &output) {
+  std::string initOutputIndexError;
+  if (IndexUnitWriter::initIndexDirectory(output.path, initOutputIndexError)) {
+    errs() << "error: failed to initialize index store; "
+           << initOutputIndexError << "\n";
+    return false;
+  }
+
+  removeStaleStagingStores(output.path);
+
+  SmallString<256> stagingPath;
+  if (std::error_code ec = fs::createUniqueDirectory(
+          output.path + "/" + StagingPrefix +
+              Twine(sys::Process::getProcessId()),
+          stagingPath)) {
+    errs() << "error: failed to create staging directory in " << output.path
+           << "; " << ec.message() << "\n";
+    return false;
+  }
+  output.stagingPath = stagingPath.str().str();
+  path::append(output.stagingUnitsPath, output.stagingPath, "v5", "units");
+
+  std::string initStagingIndexError;
+  if (IndexUnitWriter::initIndexDirectory(output.stagingPath,
+                                          initStagingIndexError)) {
+    errs() << "error: failed to initialize index store; "
+           << initStagingIndexError << "\n";
+    return false;
+  }
+
+  SmallString<256> metadataPath;
+  path::append(metadataPath, output.path, UnitMetadata::FileName);
+  output.metadata->load(metadataPath);
+
+  return true;
+}
+
 int main(int argc, char **argv) {
   cl::ParseCommandLineOptions(argc, argv);
 
-  OutputIndexPath = normalizePath(OutputIndexPath);
+  if (IndexStorePaths.size() < 2 && ExplainPaths.empty()) {
+    errs() << "error: expected one or more input index stores, followed by "
+              "the output index store\n";
+    return EXIT_FAILURE;
+  }
+  if (not IndexStorePaths.empty()) {
+    InputIndexPaths.assign(IndexStorePaths.begin(),
+                           std::prev(IndexStorePaths.end()));
+    OutputIndexPath = normalizePath(IndexStorePaths.back());
+  }
 
   PathRemapper clangPathRemapper;
   for (const auto &clangPathMapping : FilePrefixMaps) {
@@ -525,12 +1479,19 @@ int main(int argc, char **argv) {
     clangPathRemapper.addMapping(split.first, split.second);
   }
 
-  Remapper remapper;
+  std::vector<OutputStore> outputs;
+  outputs.emplace_back(OutputIndexPath);
+  for (const auto &outputIndexPath : AdditionalOutputIndexPaths) {
+    outputs.emplace_back(normalizePath(outputIndexPath));
+  }
+
   // Parse the the path remapping command line flags. This converts strings of
   // "X=Y" into a (regex, string) pair. Another way of looking at it: each
   // remap is equivalent to the s/pattern/replacement/ operator.
   auto errors = 0;
-  for (const auto &remap : PathRemaps) {
+  for (size_t remapArgIndex = 0; remapArgIndex < PathRemaps.size();
+       ++remapArgIndex) {
+    const auto &remap = PathRemaps[remapArgIndex];
     auto divider = remap.find('=');
     auto pattern = remap.substr(0, divider);
     std::shared_ptr<re2::RE2> re = std::make_shared<re2::RE2>(pattern);
@@ -546,7 +1507,18 @@ int main(int argc, char **argv) {
       continue;
     }
 
-    remapper.addRemap(re, replacement);
+    // The remap belongs to the closest -output-store flag before it, or to
+    // the positional output store if there is none.
+    size_t outputIndex = 0;
+    const unsigned remapPosition = PathRemaps.getPosition(remapArgIndex);
+    for (size_t index = 0; index < AdditionalOutputIndexPaths.size();
+         ++index) {
+      if (AdditionalOutputIndexPaths.getPosition(index) < remapPosition) {
+        outputIndex = index + 1;
+      }
+    }
+
+    outputs[outputIndex].remapper.addRemap(re, replacement, remap);
   }
 
   if (errors) {
@@ -555,43 +1527,70 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
-  std::string initOutputIndexError;
-  if (IndexUnitWriter::initIndexDirectory(OutputIndexPath,
-                                          initOutputIndexError)) {
-    errs() << "error: failed to initialize index store; "
-           << initOutputIndexError << "\n";
-    return EXIT_FAILURE;
+  if (not ExplainPaths.empty()) {
+    for (const auto &output : outputs) {
+      if (outputs.size() > 1) {
+        outs() << "Output store: " << output.path << "\n";
+      }
+      for (const auto &path : ExplainPaths) {
+        output.remapper.explain(path, outs());
+      }
+    }
+    return EXIT_SUCCESS;
   }
 
-  if (ParallelStride == 0 || ParallelStride >= InputIndexPaths.size()) {
-    bool success = true;
-    for (auto &InputIndexPath : InputIndexPaths) {
-      InputIndexPath = normalizePath(InputIndexPath);
-      if (not remapIndex(remapper, clangPathRemapper, InputIndexPath,
-                         OutputIndexPath)) {
+  if (RemapProfiling) {
+    for (auto &output : outputs) {
+      output.remapper.enableProfiling();
+    }
+  }
+
+  bool initialized = true;
+  for (auto &output : outputs) {
+    if (not initOutputStore(output)) {
+      initialized = false;
+      break;
+    }
+  }
+
+  bool success = initialized && importIndexes(clangPathRemapper, outputs);
+
+  if (initialized) {
+    for (const auto &output : outputs) {
+      SmallString<256> metadataPath;
+      path::append(metadataPath, output.path, UnitMetadata::FileName);
+      std::string saveMetadataError;
+      if (not output.metadata->save(metadataPath, output.unitsPath,
+                                    saveMetadataError)) {
+        errs() << "error: failed to write " << metadataPath << "; "
+               << saveMetadataError << "\n";
         success = false;
       }
     }
-    return success ? EXIT_SUCCESS : EXIT_FAILURE;
   }
 
-  // Process the data stores in groups according to the parallel stride.
-  const size_t stride = static_cast<size_t>(ParallelStride);
-  const size_t length = InputIndexPaths.size();
-  const size_t numStrides = ((length - 1) / stride) + 1;
+  for (const auto &output : outputs) {
+    if (not output.stagingPath.empty()) {
+      fs::remove_directories(output.stagingPath);
+    }
+  }
 
-  __block bool success = true;
-  dispatch_apply(numStrides, DISPATCH_APPLY_AUTO, ^(size_t strideIndex) {
-    const size_t start = strideIndex * stride;
-    const size_t end = std::min(start + stride, length);
-    for (size_t index = start; index < end; ++index) {
-      std::string InputIndexPath = normalizePath(InputIndexPaths[index]);
-      if (not remapIndex(remapper, clangPathRemapper, InputIndexPath,
-                         OutputIndexPath)) {
-        success = false;
+  if (not initialized) {
+    return EXIT_FAILURE;
+  }
+
+  if (ImportStats) {
+    printImportStats(outputs.size());
+  }
+
+  if (RemapProfiling) {
+    for (const auto &output : outputs) {
+      if (outputs.size() > 1) {
+        outs() << "Output store: " << output.path << "\n";
       }
+      output.remapper.printProfile(outs());
     }
-  });
+  }
 
   return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
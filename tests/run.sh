@@ -289,5 +289,353 @@ for record in {input1,input2}/v5/records/*; do
     diff -q -r "$record" output/v5/records/"$(basename "$record")"
 done
 
+# Concurrent imports into the same store keep each other's unit metadata.
+rm -fr output
+"$index_import" \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input1 output &
+"$index_import" \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input2 output
+wait $!
+grep -q ' output1\.c\.o-383YT9Q6Q1VBR$' output/index-import-metadata
+grep -q ' output2\.c\.o-3OMGQ7MOFBSUX$' output/index-import-metadata
+
+# Metadata of units that were removed from the store is dropped.
+rm output/v5/units/output1.c.o-383YT9Q6Q1VBR
+"$index_import" \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input2 output
+[[ $(grep -c ' output1\.c\.o-' output/index-import-metadata || true) == 0 ]]
+grep -q ' output2\.c\.o-3OMGQ7MOFBSUX$' output/index-import-metadata
+
 echo "Multiple indexes tests passed"
 popd >/dev/null
+
+############################################################
+
+echo "Testing unchanged units are not rewritten"
+pushd "$base_dir"/clang >/dev/null
+
+# Clean any test state from previous runs.
+rm -fr input output
+
+# Produce the index.
+clang -fsyntax-only -index-store-path input input.c "-ffile-prefix-map=$PWD=."
+
+"$index_import" \
+  -remap '\./input.c.o=output.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input output
+
+unit=output/v5/units/output.c.o-2LQD3ZSM9CGHD
+mtime_before=$(stat -f %m "$unit")
+sleep 1
+
+# Simulate a staging store left behind by an import that didn't exit normally,
+# using the ID of a process that has exited, and the staging store of an import
+# that is still running.
+sleep 0 &
+dead_pid=$!
+wait "$dead_pid"
+mkdir -p "output/index-import-staging-$dead_pid-stale/v5/units"
+mkdir -p "output/index-import-staging-$$-live/v5/units"
+
+"$index_import" \
+  -import-stats \
+  -remap '\./input.c.o=output.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input output \
+  | grep -q '^Units modified: 0$'
+
+# Check the unit was left in place, and only the live staging store remains.
+[[ $(stat -f %m "$unit") == "$mtime_before" ]]
+[[ $(compgen -G 'output/index-import-staging-*') == "output/index-import-staging-$$-live" ]]
+
+echo "unchanged unit tests passed"
+popd >/dev/null
+
+############################################################
+
+echo "Testing incremental import of unchanged units"
+pushd "$base_dir"/clang >/dev/null
+
+# Clean any test state from previous runs.
+rm -fr input output
+
+# Produce the index.
+clang -fsyntax-only -index-store-path input input.c "-ffile-prefix-map=$PWD=."
+
+import_incremental() {
+  "$index_import" \
+    -import-stats \
+    -incremental \
+    -remap '\./input.c.o=output.c.o' \
+    -remap '^\.=/fake/working/dir' \
+    input output
+}
+
+import_incremental >/dev/null
+unit=output/v5/units/output.c.o-2LQD3ZSM9CGHD
+mtime_before=$(stat -f %m "$unit")
+
+# A rebuilt input unit with the same contents leaves the output unit alone.
+sleep 1
+touch input/v5/units/*
+stats=$(import_incremental)
+grep -q '^Units unchanged: 1$' <<<"$stats"
+[[ $(stat -f %m "$unit") == "$mtime_before" ]]
+
+# The next incremental import knows the unit is up to date, even though the
+# output unit is older than the input unit.
+stats=$(import_incremental)
+grep -q '^Units up-to-date: 1$' <<<"$stats"
+grep -q '^Units unchanged: 0$' <<<"$stats"
+[[ $(stat -f %m "$unit") == "$mtime_before" ]]
+
+echo "incremental import of unchanged units tests passed"
+popd >/dev/null
+
+############################################################
+
+echo "Testing duplicate units across indexes"
+pushd "$base_dir"/multiple >/dev/null
+
+# Clean any test state from previous runs.
+rm -fr input1 output
+
+# Produce the index.
+clang -fsyntax-only -index-store-path input1 input1.c "-ffile-prefix-map=$PWD=."
+
+# The same store passed twice produces the same output unit twice.
+"$index_import" \
+  -import-stats \
+  -parallel-stride 1 \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input1 input1 output \
+  | grep -q '^Units duplicate: 1 (50.0%)$'
+
+ls output/v5/units/output1.c.o-383YT9Q6Q1VBR >/dev/null
+
+# Only the working directory and output file of the duplicate are remapped,
+# so rule 2 matches 3 paths of the imported copy and 1 of the duplicate, and
+# only the imported copy's sysroot is unmatched.
+rm -fr output
+profile=$("$index_import" \
+  -remap-profile \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input1 input1 output)
+grep -q "^  1: 2 matches, [0-9.]*ms, '" <<<"$profile"
+grep -q "^  2: 4 matches, [0-9.]*ms, '" <<<"$profile"
+grep -q '^Unmatched paths: 1$' <<<"$profile"
+
+echo "duplicate unit tests passed"
+popd >/dev/null
+
+############################################################
+
+echo "Testing remap explain and profile"
+pushd "$base_dir"/multiple >/dev/null
+
+# Clean any test state from previous runs.
+rm -fr input1 output
+
+# Produce the index.
+clang -fsyntax-only -index-store-path input1 input1.c "-ffile-prefix-map=$PWD=."
+
+explanation=$("$index_import" \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  -explain ./input1.c.o \
+  -explain /elsewhere/input1.c)
+
+grep -qF "  rule 1: '^\./input(.).c.o=output\$1.c.o'" <<<"$explanation"
+grep -q '^  result: output1.c.o$' <<<"$explanation"
+grep -q '^  no rule matched$' <<<"$explanation"
+
+# Explaining paths doesn't need index stores, but importing does.
+if "$index_import" input1 2>/dev/null; then
+    exit 1
+fi
+[[ ! -e output ]]
+
+profile=$("$index_import" \
+  -remap-profile \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input1 output)
+
+# The output file matches rule 1. The working directory, main file and record
+# dependency match rule 2, and the sysroot matches no rule.
+grep -q "^  1: 1 matches, [0-9.]*ms, '" <<<"$profile"
+grep -q "^  2: 3 matches, [0-9.]*ms, '" <<<"$profile"
+grep -q '^Unmatched paths: 1$' <<<"$profile"
+
+echo "remap explain and profile tests passed"
+popd >/dev/null
+
+############################################################
+
+echo "Testing multiple output stores"
+pushd "$base_dir"/clang >/dev/null
+
+# Clean any test state from previous runs.
+rm -fr input output output2
+
+# Produce the index.
+clang -fsyntax-only -index-store-path input input.c "-ffile-prefix-map=$PWD=."
+
+"$index_import" \
+  -remap '\./input.c.o=output.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input output \
+  -output-store output2 \
+  -remap '\./input.c.o=output2.c.o' \
+  -remap '^\.=/other/working/dir'
+
+# See https://llvm.org/docs/CommandGuide/FileCheck.html
+"$absolute_unit" \
+  output/v5/units/* \
+  | FileCheck expected.txt
+
+# Check that each store got its own remapped unit.
+ls output/v5/units/output.c.o-2LQD3ZSM9CGHD >/dev/null
+ls output2/v5/units/output2.c.o-* >/dev/null
+"$absolute_unit" output2/v5/units/* | grep -q '^WorkingDirectory: /other/working/dir$'
+
+# Check that records are shared between the output stores.
+[[ output/v5/records/MX/input.c-1N81D6PPYGQMX -ef output2/v5/records/MX/input.c-1N81D6PPYGQMX ]]
+
+echo "multiple output stores tests passed"
+popd >/dev/null
+
+############################################################
+
+echo "Testing absolute-unit with index stores"
+pushd "$base_dir"/multiple >/dev/null
+
+# Clean any test state from previous runs.
+rm -fr input1 input2 output
+
+# Produce the two indexes.
+clang -fsyntax-only -index-store-path input1 input1.c "-ffile-prefix-map=$PWD=."
+clang -fsyntax-only -index-store-path input2 input2.c "-ffile-prefix-map=$PWD=."
+
+"$index_import" \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input1 input2 output
+
+# Passing the store is the same as passing all of its units.
+diff <("$absolute_unit" output) <("$absolute_unit" output/v5/units/*)
+
+# Filters are applied before output, one JSON object per line.
+units=$("$absolute_unit" -format=jsonl -output-file-regex 'output2\.c\.o$' output)
+[[ $(wc -l <<<"$units") -eq 1 ]]
+grep -q '"OutputFile":"/fake/working/dir/output2.c.o"' <<<"$units"
+
+units=$("$absolute_unit" -format=jsonl -dependency /fake/working/dir/input1.c output)
+[[ $(wc -l <<<"$units") -eq 1 ]]
+grep -q '"MainFilePath":"/fake/working/dir/input1.c"' <<<"$units"
+
+echo "absolute-unit with index stores tests passed"
+popd >/dev/null
+
+############################################################
+
+echo "Testing priority import"
+pushd "$base_dir"/multiple >/dev/null
+
+# Clean any test state from previous runs.
+rm -fr input input1 input2 output
+
+# Produce the two indexes.
+clang -fsyntax-only -index-store-path input1 input1.c "-ffile-prefix-map=$PWD=."
+clang -fsyntax-only -index-store-path input2 input2.c "-ffile-prefix-map=$PWD=."
+
+"$index_import" \
+  -import-stats \
+  -priority-recent \
+  -priority-main-file /fake/working/dir/input2.c \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input1 input2 output \
+  | grep -q '^Units prioritized: 1$'
+
+# See https://llvm.org/docs/CommandGuide/FileCheck.html
+"$absolute_unit" \
+  output/v5/units/* \
+  | FileCheck expected.txt
+
+# Check that all records were imported by the second wave.
+for record in {input1,input2}/v5/records/*; do
+    diff -q -r "$record" output/v5/records/"$(basename "$record")"
+done
+
+# Succeeds if the status of the first file changed before the second one's.
+# Status change times are updated when units are moved into place and when
+# records are copied.
+changed_before() {
+    awk -v first="$(stat -f %Fc "$1")" -v second="$(stat -f %Fc "$2")" \
+        'BEGIN { exit !(first < second) }'
+}
+
+# The priority unit and its record are installed before the deferred unit,
+# even though input1 is imported first without priority flags.
+rm -fr output
+"$index_import" \
+  -parallel-stride 0 \
+  -priority-main-file /fake/working/dir/input2.c \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input1 input2 output
+
+changed_before output/v5/units/output2.c.o-* output/v5/units/output1.c.o-*
+changed_before output/v5/records/FG/input2.c-V47TGXUYI0FG output/v5/units/output1.c.o-*
+
+# With -priority-recent-count, the most recently modified units across all
+# input stores are imported first.
+rm -fr output
+touch -t 202001010000 input1/v5/units/*
+touch input2/v5/units/*
+"$index_import" \
+  -import-stats \
+  -parallel-stride 0 \
+  -priority-recent-count 1 \
+  -remap '^\./input(.).c.o=output$1.c.o' \
+  -remap '^\.=/fake/working/dir' \
+  input1 input2 output \
+  | grep -q '^Units prioritized: 1$'
+changed_before output/v5/units/output2.c.o-* output/v5/units/output1.c.o-*
+
+# With -priority-recent, the most recently modified units are imported first.
+rm -fr input output
+clang -fsyntax-only -index-store-path input input1.c input2.c "-ffile-prefix-map=$PWD=."
+
+import_recent() {
+    rm -fr output
+    "$index_import" \
+      -parallel-stride 0 \
+      -priority-recent \
+      -remap '^\./input(.).c.o=output$1.c.o' \
+      -remap '^\.=/fake/working/dir' \
+      input output
+}
+
+touch -t 202001010000 input/v5/units/input2.c.o-*
+touch input/v5/units/input1.c.o-*
+import_recent
+changed_before output/v5/units/output1.c.o-* output/v5/units/output2.c.o-*
+
+touch -t 202001010000 input/v5/units/input1.c.o-*
+touch input/v5/units/input2.c.o-*
+import_recent
+changed_before output/v5/units/output2.c.o-* output/v5/units/output1.c.o-*
+
+echo "priority import tests passed"
+popd >/dev/null